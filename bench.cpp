@@ -0,0 +1,761 @@
+/********************************************************
+ * cstat_bench -- Measures how fast cstat lexes and		*
+ *			collects statistics, on a corpus of made up	*
+ *			C++ that is the same on every run.			*
+ *														*
+ * Usage:												*
+ *		cstat_bench [--baseline file] [--save file]		*
+ *					[--tolerance percent]				*
+ *					[--generate directory]				*
+ *														*
+ * Each benchmark is run several times and the median	*
+ * run counts.  With --baseline the results are			*
+ * compared against ones saved earlier with --save,		*
+ * and the program fails if any is slower by more than	*
+ * the tolerance.  A baseline is only good for the		*
+ * machine it was saved on, so make bench-baseline		*
+ * makes one there rather than one being kept with		*
+ * the sources.  Before anything is timed the vector	*
+ * scans are checked against the scalar ones, for		*
+ * every character in every place in a block.			*
+ *														*
+ * Author: Adam Pearce									*
+ ********************************************************/
+#include "char_scan.h"
+#include "char_type.h"
+#include "cpp_stat.h"
+#include "input_file.h"
+#include "output_buffer.h"
+#include "token.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+
+// Where the corpus is written for the process_file benchmarks
+static const char* const corpus_directory = "bench_corpus";
+
+// Each benchmark is run this many times and the median kept
+static const int repeats = 7;
+
+// A run repeats the work until it has taken at least this many seconds
+static const double minimum_run = 0.2;
+
+// Results slower than the baseline by more than this percentage fail
+static const double default_tolerance = 25.0;
+
+/********************************************************
+ * class generator -- Writes made up C++ from a fixed	*
+ *				seed.									*
+ *														*
+ * The random numbers come from xorshift rather than	*
+ * the standard library, whose distributions are		*
+ * allowed to differ between implementations.			*
+ ********************************************************/
+class generator {
+public:
+	explicit generator(uint64_t seed) { state = seed; }
+
+	// A number from 0 to limit - 1
+	unsigned below(unsigned limit) {
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		return (unsigned(state % limit));
+	}
+
+	// true one time in chance
+	bool one_in(unsigned chance) { return (below(chance) == 0); }
+
+	// Append an identifier
+	void identifier(std::string& out) {
+		static const char* const names[] = {
+			"count", "index", "buffer", "next_token", "file", "result",
+			"line", "value", "stats", "i", "size", "begin", "end", "ptr"
+		};
+		out += names[below(sizeof(names) / sizeof(names[0]))];
+	}
+
+	// Append an expression
+	void expression(std::string& out, int depth) {
+		identifier(out);
+		for (unsigned term = below(4); term > 0; --term)
+		{
+			static const char* const operators[] = {
+				" + ", " - ", " * ", " / ", " == ", " && ", " << ", "->"
+			};
+			out += operators[below(sizeof(operators) / sizeof(operators[0]))];
+
+			if ((depth > 0) && one_in(3))
+			{
+				out += '(';
+				expression(out, depth - 1);
+				out += ')';
+			}
+			else if (one_in(2))
+				out += std::to_string(below(100000));
+			else
+				identifier(out);
+		}
+	}
+
+	// Append a string literal with some escapes in it
+	void string_literal(std::string& out) {
+		static const char* const pieces[] = {
+			"hello", " world", "\\n", "\\\"", "%d", "\\\\", " /* not a comment */",
+			"// nor this", "{(", "\\t"
+		};
+		out += '"';
+		for (unsigned piece = below(8); piece > 0; --piece)
+			out += pieces[below(sizeof(pieces) / sizeof(pieces[0]))];
+		out += '"';
+	}
+
+	// Append a statement, with line breaks if newlines is set
+	void statement(std::string& out, const char* indent, bool newlines) {
+		out += indent;
+		switch (below(5))
+		{
+			case 0:
+				out += "int ";
+				identifier(out);
+				out += " = ";
+				expression(out, 2);
+				break;
+			case 1:
+				identifier(out);
+				out += '(';
+				expression(out, 1);
+				out += ", ";
+				string_literal(out);
+				out += ')';
+				break;
+			case 2:
+				out += "if (";
+				expression(out, 2);
+				out += ") ";
+				identifier(out);
+				out += "++";
+				break;
+			case 3:
+				out += "std::cout << ";
+				string_literal(out);
+				out += " << '\\n'";
+				break;
+			default:
+				out += "return (";
+				expression(out, 3);
+				out += ')';
+				break;
+		}
+		out += ';';
+		out += newlines ? '\n' : ' ';
+	}
+
+private:
+	uint64_t state;		// The xorshift state
+};
+
+/********************************************************
+ * make_code -- Ordinary code, a few functions with		*
+ *				comments between them.					*
+ ********************************************************/
+static std::string make_code(size_t size, uint64_t seed)
+{
+	generator random(seed);
+	std::string out;
+
+	while (out.size() < size)
+	{
+		out += "/********************************************************\n";
+		out += " * function -- Does something.                          *\n";
+		out += " ********************************************************/\n";
+		out += "int function_" + std::to_string(out.size()) + "(int count)\n{\n";
+
+		for (unsigned line = 5 + random.below(30); line > 0; --line)
+		{
+			random.statement(out, "\t", true);
+			if (random.one_in(6))
+				out += "\t// A note about the line above\n";
+			if (random.one_in(10))
+				out += '\n';
+		}
+		out += "}\n\n";
+	}
+	return (out);
+}
+
+/********************************************************
+ * make_comments -- Mostly comments.					*
+ ********************************************************/
+static std::string make_comments(size_t size, uint64_t seed)
+{
+	generator random(seed);
+	std::string out;
+
+	while (out.size() < size)
+	{
+		switch (random.below(4))
+		{
+			case 0:
+				out += "/*\n * A block comment running over a few lines, with\n";
+				out += " * a * and a / in it but not together.\n */\n";
+				break;
+			case 1:
+				out += "// A line comment about the code below it\n";
+				break;
+			case 2:
+				out += "int value = 1; /* trailing */ // and another\n";
+				break;
+			default:
+				random.statement(out, "", false);
+				out += "// code and a comment\n";
+				break;
+		}
+	}
+	return (out);
+}
+
+/********************************************************
+ * make_strings -- Mostly string and character literals	*
+ ********************************************************/
+static std::string make_strings(size_t size, uint64_t seed)
+{
+	generator random(seed);
+	std::string out;
+
+	while (out.size() < size)
+	{
+		out += "const char* text = ";
+		for (unsigned part = 1 + random.below(4); part > 0; --part)
+		{
+			random.string_literal(out);
+			out += ' ';
+		}
+		out += ";\nchar c = '\\'';\n";
+
+		// A string carried on to the next line
+		if (random.one_in(8))
+			out += "\"first line \\\nsecond line\";\n";
+	}
+	return (out);
+}
+
+/********************************************************
+ * make_nested -- Deeply nested braces and parentheses	*
+ ********************************************************/
+static std::string make_nested(size_t size, uint64_t seed)
+{
+	generator random(seed);
+	std::string out;
+
+	while (out.size() < size)
+	{
+		unsigned depth = 10 + random.below(40);
+
+		for (unsigned level = 0; level < depth; ++level)
+			out += "if ((((a))) && (b)) {\n";
+
+		random.statement(out, "", true);
+
+		for (unsigned level = 0; level < depth; ++level)
+			out += "}\n";
+	}
+	return (out);
+}
+
+/********************************************************
+ * make_minified -- Code on one line, as a minifier		*
+ *				would leave it.							*
+ ********************************************************/
+static std::string make_minified(size_t size, uint64_t seed)
+{
+	generator random(seed);
+	std::string out;
+
+	while (out.size() < size)
+	{
+		out += "int f" + std::to_string(out.size()) + "(int count){";
+		for (unsigned line = 5 + random.below(30); line > 0; --line)
+			random.statement(out, "", false);
+		out += "}";
+	}
+	out += '\n';
+	return (out);
+}
+
+/********************************************************
+ * struct profile -- One kind of source in the corpus.	*
+ ********************************************************/
+struct profile {
+	const char* name;		// Used in the results and the file name
+	size_t size;			// Roughly how many bytes to make
+	std::string (*make)(size_t size, uint64_t seed);
+	bool micro;				// Run the microbenchmarks on it
+};
+
+static const profile profiles[] = {
+	{ "code", 4 << 20, make_code, true },
+	{ "comments", 4 << 20, make_comments, true },
+	{ "strings", 4 << 20, make_strings, true },
+	{ "nested", 4 << 20, make_nested, true },
+	{ "minified", 4 << 20, make_minified, true },
+	{ "huge", 32 << 20, make_code, false }
+};
+
+/********************************************************
+ * struct result -- How fast one benchmark ran.			*
+ ********************************************************/
+struct result {
+	std::string name;		// benchmark/profile
+	double bytes_per_second;
+	double tokens_per_second;	// 0 if tokens aren't counted
+};
+
+/********************************************************
+ * time_median -- Time a piece of work, keeping			*
+ *				the median of several runs.				*
+ *														*
+ * Work that is over quickly is done several times in	*
+ * each run, so the timer and the odd interruption		*
+ * don't swamp it.										*
+ *														*
+ * Parameters											*
+ *		work -- The work to time						*
+ *														*
+ * Returns												*
+ *		The median time for doing the work once, in		*
+ *		seconds											*
+ ********************************************************/
+template <class WORK>
+static double time_median(WORK work)
+{
+	std::vector<double> times;
+
+	for (int run = 0; run < repeats; ++run)
+	{
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		std::chrono::duration<double> taken;
+		int done = 0;
+
+		do {
+			work();
+			++done;
+			taken = std::chrono::steady_clock::now() - start;
+		} while (taken.count() < minimum_run);
+
+		times.push_back(taken.count() / done);
+	}
+
+	std::nth_element(times.begin(), times.begin() + times.size() / 2, times.end());
+	return (times[times.size() / 2]);
+}
+
+// Stops the compiler throwing away work whose result isn't used
+static volatile unsigned long sink;
+
+/********************************************************
+ * lex_all -- Lex a whole buffer into a list of token	*
+ *				types.									*
+ ********************************************************/
+static void lex_all(const std::string& text, std::vector<token::TOKEN_TYPE>& types)
+{
+	input_file in_file(text.data(), text.data() + text.size());
+	token lexer;
+
+	in_file.set_keep_line(false);
+	types.clear();
+
+	while (true)
+	{
+		token::TOKEN_TYPE type = lexer.next_token(in_file);
+
+		if (type == token::T_END_OF_FILE)
+			break;
+		types.push_back(type);
+	}
+}
+
+/********************************************************
+ * bench_collector -- Time one set of collectors taking	*
+ *				tokens that were lexed beforehand.		*
+ ********************************************************/
+template <class STATS>
+static result bench_collector(const char* name, const profile& kind,
+	const std::string& text, const std::vector<token::TOKEN_TYPE>& types)
+{
+	double seconds = time_median([&types]() {
+		STATS stats;
+
+		for (size_t index = 0; index < types.size(); ++index)
+			stats.take_token(types[index]);
+
+		output_buffer out;
+		stats.output_file_stats(out);
+		sink = sink + out.size();
+	});
+
+	result timing;
+	timing.name = std::string(name) + "/" + kind.name;
+	timing.bytes_per_second = text.size() / seconds;
+	timing.tokens_per_second = types.size() / seconds;
+	return (timing);
+}
+
+/********************************************************
+ * bench_identifiers -- Time identifier_counter taking	*
+ *				the identifiers in a buffer, which are	*
+ *				found beforehand.						*
+ ********************************************************/
+static result bench_identifiers(const profile& kind, const std::string& text)
+{
+	input_file in_file(text.data(), text.data() + text.size());
+	token lexer;
+	token_batch batch;
+	std::vector<std::pair<const char*, size_t> > identifiers;
+
+	in_file.set_keep_line(false);
+
+	do {
+		lexer.next_tokens(in_file, batch, in_file.end_position());
+
+		for (size_t index = 0; index < batch.size(); ++index)
+		{
+			if (batch.type(index) == token::T_ID)
+				identifiers.push_back(std::make_pair(batch.text(index),
+					batch.length(index)));
+		}
+	} while (batch.full());
+
+	double seconds = time_median([&identifiers]() {
+		identifier_counter counter;
+
+		for (size_t index = 0; index < identifiers.size(); ++index)
+			counter.take_identifier(identifiers[index].first,
+				identifiers[index].second);
+
+		output_buffer out;
+		counter.output_file_stats(out);
+		sink = sink + out.size();
+	});
+
+	result timing;
+	timing.name = std::string("identifier_counter/") + kind.name;
+	timing.bytes_per_second = text.size() / seconds;
+	timing.tokens_per_second = identifiers.size() / seconds;
+	return (timing);
+}
+
+/********************************************************
+ * bench_functions -- Time function_counter taking the	*
+ *				batches of tokens in a buffer, which	*
+ *				are lexed beforehand.					*
+ ********************************************************/
+static result bench_functions(const profile& kind, const std::string& text)
+{
+	input_file in_file(text.data(), text.data() + text.size());
+	token lexer;
+	std::vector<token_batch> batches;
+	size_t tokens = 0;
+
+	in_file.set_keep_line(false);
+
+	do {
+		batches.emplace_back();
+		lexer.next_tokens(in_file, batches.back(), in_file.end_position());
+		tokens += batches.back().size();
+	} while (batches.back().full());
+
+	double seconds = time_median([&batches]() {
+		function_counter counter;
+
+		for (size_t index = 0; index < batches.size(); ++index)
+			counter.take_batch(batches[index]);
+
+		output_buffer out;
+		counter.output_file_stats(out);
+		sink = sink + out.size();
+	});
+
+	result timing;
+	timing.name = std::string("function_counter/") + kind.name;
+	timing.bytes_per_second = text.size() / seconds;
+	timing.tokens_per_second = tokens / seconds;
+	return (timing);
+}
+
+/********************************************************
+ * bench_micro -- The microbenchmarks for one profile.	*
+ ********************************************************/
+static void bench_micro(const profile& kind, const std::string& text,
+	std::vector<result>& results)
+{
+	std::vector<token::TOKEN_TYPE> types;
+	result timing;
+
+	// char_type::type on every character
+	double seconds = time_median([&text]() {
+		unsigned long total = 0;
+
+		for (size_t index = 0; index < text.size(); ++index)
+			total += char_type::type((unsigned char)text[index]);
+		sink = total;
+	});
+
+	timing.name = std::string("char_type/") + kind.name;
+	timing.bytes_per_second = text.size() / seconds;
+	timing.tokens_per_second = 0;
+	results.push_back(timing);
+
+	// token::next_token over the whole text
+	seconds = time_median([&text, &types]() { lex_all(text, types); });
+
+	timing.name = std::string("next_token/") + kind.name;
+	timing.bytes_per_second = text.size() / seconds;
+	timing.tokens_per_second = types.size() / seconds;
+	results.push_back(timing);
+
+	// Each collector on its own, then all of them together
+	results.push_back(bench_collector<stat_pipeline<line_counter> >(
+		"line_counter", kind, text, types));
+	results.push_back(bench_collector<stat_pipeline<nest_counter> >(
+		"nest_counter", kind, text, types));
+	results.push_back(bench_collector<stat_pipeline<comment_counter> >(
+		"comment_counter", kind, text, types));
+	results.push_back(bench_collector<
+		stat_pipeline<line_counter, nest_counter, comment_counter> >(
+		"all_collectors", kind, text, types));
+	results.push_back(bench_identifiers(kind, text));
+	results.push_back(bench_functions(kind, text));
+}
+
+/********************************************************
+ * bench_process_file -- Time process_file on one		*
+ *				profile, with and without a listing.	*
+ ********************************************************/
+static void bench_process_file(const profile& kind, const std::string& path,
+	size_t size, size_t tokens, std::vector<result>& results)
+{
+	for (int summary = 0; summary < 2; ++summary)
+	{
+		stat_options options;
+		options.summary = (summary != 0);
+
+		double seconds = time_median([&path, &options]() {
+			output_buffer out;
+			process_file(path.c_str(), out, options);
+			sink = sink + out.size();
+		});
+
+		result timing;
+		timing.name = std::string(summary ? "summary/" : "listing/") + kind.name;
+		timing.bytes_per_second = size / seconds;
+		timing.tokens_per_second = (tokens != 0) ? tokens / seconds : 0;
+		results.push_back(timing);
+	}
+}
+
+/********************************************************
+ * write_file -- Write a string to a file.				*
+ ********************************************************/
+static bool write_file(const std::string& path, const std::string& text)
+{
+	std::ofstream out(path.c_str(), std::ios::binary);
+
+	out.write(text.data(), text.size());
+	return (out.good());
+}
+
+/********************************************************
+ * read_baseline -- Read the results saved by --save.	*
+ *														*
+ * Each line is a benchmark name and its bytes per		*
+ * second, lines starting with '#' are comments.		*
+ ********************************************************/
+static bool read_baseline(const char* path, std::map<std::string, double>& baseline)
+{
+	std::ifstream in(path);
+
+	if (!in.is_open())
+		return (false);
+
+	std::string line;
+	while (std::getline(in, line))
+	{
+		if (line.empty() || (line[0] == '#'))
+			continue;
+
+		size_t space = line.find(' ');
+		if (space != std::string::npos)
+			baseline[line.substr(0, space)] = atof(line.c_str() + space + 1);
+	}
+	return (true);
+}
+
+/********************************************************
+ * save_baseline -- Save the results for later runs to	*
+ *				compare against.						*
+ ********************************************************/
+static bool save_baseline(const char* path, const std::vector<result>& results)
+{
+	std::ofstream out(path);
+
+	out << "# cstat_bench baseline: benchmark, bytes per second\n";
+	out << "# Made with make bench-baseline, on the machine the bench is run on\n";
+
+	for (size_t index = 0; index < results.size(); ++index)
+		out << results[index].name << ' ' << std::fixed << std::setprecision(0) <<
+			results[index].bytes_per_second << '\n';
+
+	return (out.good());
+}
+
+/********************************************************
+ * usage -- Tell the user how to run the program.		*
+ ********************************************************/
+static void usage()
+{
+	std::cerr << "Usage: cstat_bench [options]\n";
+	std::cerr << "Options:\n";
+	std::cerr << "  --baseline FILE     Fail if slower than the results in FILE\n";
+	std::cerr << "  --save FILE         Save the results to FILE as a baseline\n";
+	std::cerr << "  --tolerance PERCENT How much slower than the baseline is allowed\n";
+	std::cerr << "                      (default: 25)\n";
+	std::cerr << "  --generate DIR      Only write the corpus to DIR\n";
+}
+
+int main(int argc, char* argv[])
+{
+	const char* baseline_path = 0;
+	const char* save_path = 0;
+	const char* generate_path = 0;
+	double tolerance = default_tolerance;
+
+	for (int index = 1; index < argc; ++index)
+	{
+		const char* value = (index + 1 < argc) ? argv[index + 1] : 0;
+
+		if ((strcmp(argv[index], "--baseline") == 0) && (value != 0))
+			baseline_path = value;
+		else if ((strcmp(argv[index], "--save") == 0) && (value != 0))
+			save_path = value;
+		else if ((strcmp(argv[index], "--tolerance") == 0) && (value != 0))
+			tolerance = atof(value);
+		else if ((strcmp(argv[index], "--generate") == 0) && (value != 0))
+			generate_path = value;
+		else
+		{
+			usage();
+			return (2);
+		}
+		++index;
+	}
+
+	// Faster scans that stop in the wrong places aren't worth timing
+	if (!char_scan::check(char_scan::L_SSE2) || !char_scan::check(char_scan::L_AVX2))
+	{
+		std::cerr << "Error: The vector scans don't agree with the scalar ones\n";
+		return (2);
+	}
+
+	std::string directory = (generate_path != 0) ? generate_path : corpus_directory;
+	mkdir(directory.c_str(), 0777);
+
+	std::vector<result> results;
+
+	for (size_t index = 0; index < sizeof(profiles) / sizeof(profiles[0]); ++index)
+	{
+		const profile& kind = profiles[index];
+		std::string text = kind.make(kind.size, index + 1);
+		std::string path = directory + "/" + kind.name + ".cpp";
+
+		if (!write_file(path, text))
+		{
+			std::cerr << "Error: Unable to write file: " << path << '\n';
+			return (2);
+		}
+
+		if (generate_path != 0)
+			continue;
+
+		std::vector<token::TOKEN_TYPE> types;
+		lex_all(text, types);
+
+		if (kind.micro)
+			bench_micro(kind, text, results);
+
+		bench_process_file(kind, path, text.size(), types.size(), results);
+	}
+
+	if (generate_path != 0)
+		return (0);
+
+	std::map<std::string, double> baseline;
+
+	if ((baseline_path != 0) && !read_baseline(baseline_path, baseline))
+	{
+		std::cerr << "Error: Unable to read baseline: " << baseline_path << '\n';
+		return (2);
+	}
+
+	int regressions = 0;
+
+	std::cout << std::left << std::setw(28) << "benchmark" << std::right <<
+		std::setw(10) << "MB/s" << std::setw(12) << "Mtokens/s" <<
+		std::setw(12) << "baseline" << '\n';
+
+	for (size_t index = 0; index < results.size(); ++index)
+	{
+		const result& timing = results[index];
+
+		std::cout << std::left << std::setw(28) << timing.name << std::right <<
+			std::fixed << std::setprecision(1) <<
+			std::setw(10) << timing.bytes_per_second / 1e6;
+
+		if (timing.tokens_per_second != 0)
+			std::cout << std::setw(12) << timing.tokens_per_second / 1e6;
+		else
+			std::cout << std::setw(12) << "-";
+
+		std::map<std::string, double>::const_iterator base = baseline.find(timing.name);
+
+		if (base != baseline.end())
+		{
+			double change = (timing.bytes_per_second / base->second - 1) * 100;
+
+			std::cout << std::setw(11) << std::showpos << change << std::noshowpos << '%';
+
+			if (change < -tolerance)
+			{
+				std::cout << "  REGRESSION";
+				++regressions;
+			}
+		}
+		std::cout << '\n';
+	}
+
+	if ((save_path != 0) && !save_baseline(save_path, results))
+	{
+		std::cerr << "Error: Unable to write baseline: " << save_path << '\n';
+		return (2);
+	}
+
+	if (regressions != 0)
+	{
+		std::cerr << "Error: " << regressions <<
+			" benchmarks slower than the baseline by more than " <<
+			tolerance << "%\n";
+		return (1);
+	}
+	return (0);
+}